@@ -8,9 +8,58 @@
 #include <limits.h>
 #include <float.h>
 #include <signal.h>
+#include <time.h>
 #define MIN(a, b) ((a) < (b) ? a : b)
 #define MAX(a, b) ((a) > (b) ? a : b)
 
+// QoS class configuration: "<domain name> <dedicated|shared|batch>" per line, overrides domain metadata
+#ifndef QOS_CONFIG_FILE
+#define QOS_CONFIG_FILE "vcpu_qos.conf"
+#endif
+#define QOS_METADATA_URI "http://aos.project1/qos" // Namespace of <qos class="..."/> in the domain XML metadata
+#define MAX_QOS_ENTRIES 64
+
+// Consolidation tuning, enable with make CFLAGS=-DCONSOLIDATE_MODE=1
+#ifndef CONSOLIDATE_MODE
+#define CONSOLIDATE_MODE 0 // Pack VCPUs onto fewer PCPUs when total load is low
+#endif
+// The thresholds are whole percents so they can be checked here
+#ifndef CONSOLIDATE_ENTER_LOAD
+#define CONSOLIDATE_ENTER_LOAD 40 // Start packing below this % of shared PCPU capacity
+#endif
+#ifndef CONSOLIDATE_EXIT_LOAD
+#define CONSOLIDATE_EXIT_LOAD 60 // Spread out again above this % of shared PCPU capacity
+#endif
+#ifndef CONSOLIDATE_HEADROOM
+#define CONSOLIDATE_HEADROOM 20 // % of each active PCPU kept free while packing
+#endif
+#if CONSOLIDATE_HEADROOM <= 0 || CONSOLIDATE_HEADROOM >= 50
+#error "CONSOLIDATE_HEADROOM must be between 0 and 50"
+#endif
+#if CONSOLIDATE_ENTER_LOAD >= CONSOLIDATE_EXIT_LOAD
+#error "CONSOLIDATE_ENTER_LOAD must be below CONSOLIDATE_EXIT_LOAD"
+#endif
+
+#define PCPU_SHARED (-1) // PcpuLoad.owner of a PCPU that shared and batch VCPUs can use
+#define PCPU_PARKED (-2) // PcpuLoad.owner of a PCPU emptied by consolidation so it can idle
+#define MAX_RAPL_DOMAINS 8
+#define RAPL_PATH "/sys/class/powercap/intel-rapl:%d/%s"
+#define CPUFREQ_PATH "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq"
+
+typedef enum {
+    QOS_SHARED, // Balanced across the non-dedicated PCPUs (default)
+    QOS_DEDICATED, // Gets a PCPU to itself that no other VCPU is placed on
+    QOS_BATCH, // Packed onto as few non-dedicated PCPUs as possible
+    QOS_NUM_CLASSES
+} QosClass;
+
+const char* qosClassNames[QOS_NUM_CLASSES] = { "shared", "dedicated", "batch" };
+
+typedef struct {
+    char name[256]; // Domain name
+    QosClass qosClass; // Class configured for the domain
+} QosEntry;
+
 typedef struct {
     virDomainPtr domain; // Domain of VCPU
     int vcpuID; // The ID of the VCPU (useful for identifying the VCPU)
@@ -18,15 +67,38 @@ typedef struct {
     unsigned long long prevCpuTime;  // Previous CPU time for utilization calculation
     unsigned long long currCpuTime;  // Current CPU time for utilization calculation
     double utilization; // Utilization of VCPU
+    QosClass qosClass; // QoS class of the VCPU's domain
+    int dedicatedPcpu; // PCPU reserved for a dedicated VCPU, -1 if none
+    int pinnedPcpu; // PCPU the VCPU's affinity is limited to, -1 if it may run on several
 } VcpuInfo;
 
+// Per-PCPU load broken down by QoS class
+typedef struct {
+    double util; // Total utilization of VCPUs on this PCPU
+    int count; // Number of VCPUs on this PCPU
+    double classUtil[QOS_NUM_CLASSES]; // Utilization per QoS class
+    int classCount[QOS_NUM_CLASSES]; // VCPUs per QoS class
+    int owner; // Index of the dedicated VCPU that reserved this PCPU, or PCPU_SHARED/PCPU_PARKED
+} PcpuLoad;
+
 int is_exit = 0; // DO NOT MODIFY THIS VARIABLE
 VcpuInfo* vcpuInfo = NULL; // Global VCPU array
 int totalVcpus = 0; // Global total number of VCPUs
+QosEntry qosConfig[MAX_QOS_ENTRIES]; // QoS classes read from QOS_CONFIG_FILE
+int numQosEntries = 0;
+int errorHandlerInstalled = 0; // Whether libvirtErrorHandler has replaced libvirt's default error printer
+int consolidating = 0; // Whether VCPUs are currently packed onto fewer PCPUs
+int* activePcpus = NULL; // Map of shared PCPUs kept running while consolidating, kept across intervals
+int numActiveMapPcpus = 0; // Number of PCPUs activePcpus was allocated for
+unsigned long long prevEnergy[MAX_RAPL_DOMAINS]; // Last RAPL energy counter reading per package in uJ
+double prevEnergyTime[MAX_RAPL_DOMAINS]; // CLOCK_MONOTONIC time of the last reading per package in seconds
+double totalEnergy[MAX_RAPL_DOMAINS]; // Energy used per package since the scheduler started in J
 
 void CPUScheduler(virConnectPtr conn, int interval);
-int getVcpuInfo(virDomainPtr* domains, int numDomains);
+int getVcpuInfo(virDomainPtr* domains, int numDomains, int numPcpus);
 int getNumPcpus(virConnectPtr conn);
+void loadQosConfig(const char* path);
+QosClass getQosClass(virDomainPtr domain);
 
 /*
 DO NOT CHANGE THE FOLLOWING FUNCTION
@@ -76,7 +148,7 @@ int main(int argc, char* argv[])
 }
 
 // Helper Function: Get PCPU information and return total PCPUs
-int getVcpuInfo(virDomainPtr* domains, int numDomains)
+int getVcpuInfo(virDomainPtr* domains, int numDomains, int numPcpus)
 {
     // Get total VCPUs in system
     int totalVcpusTemp = 0;
@@ -101,6 +173,8 @@ int getVcpuInfo(virDomainPtr* domains, int numDomains)
             fprintf(stderr, "Error: Memory allocation failed for vcpuInfo\n");
             return 0;
         }
+        for (int i = 0; i < totalVcpusTemp; i++)
+            vcpuInfo[i].dedicatedPcpu = -1;
         totalVcpus = totalVcpusTemp;
     }
 
@@ -115,6 +189,7 @@ int getVcpuInfo(virDomainPtr* domains, int numDomains)
             continue;
         }
         int numVcpus = info.nrVirtCpu;
+        QosClass qosClass = getQosClass(domains[i]);
 
         // Allocate memory to store VCPU info for this domain
         virVcpuInfoPtr vcpuInfoArray = (virVcpuInfoPtr)malloc(sizeof(virVcpuInfo) * numVcpus);
@@ -124,11 +199,22 @@ int getVcpuInfo(virDomainPtr* domains, int numDomains)
             continue;
         }
 
+        // Allocate the affinity maps so pinning decisions use each VCPU's affinity, not just where it last ran
+        int cpumapLen = VIR_CPU_MAPLEN(numPcpus);
+        unsigned char* cpumaps = (unsigned char*)calloc(numVcpus, cpumapLen);
+        if (!cpumaps) 
+        {
+            fprintf(stderr, "Error: Memory allocation failed for cpumaps\n");
+            free(vcpuInfoArray);
+            continue;
+        }
+
         // Call virDomainGetVcpus with a valid maxinfo value
-        if (virDomainGetVcpus(domains[i], vcpuInfoArray, numVcpus, NULL, 0) < 0) 
+        if (virDomainGetVcpus(domains[i], vcpuInfoArray, numVcpus, cpumaps, cpumapLen) < 0) 
         {
             fprintf(stderr, "Error: Failed to get VCPU info for domain %d\n", i);
             free(vcpuInfoArray);
+            free(cpumaps);
             continue;
         }
 
@@ -138,6 +224,7 @@ int getVcpuInfo(virDomainPtr* domains, int numDomains)
         {
             fprintf(stderr, "Error: Failed to get number of CPU stats parameters\n");
             free(vcpuInfoArray);
+            free(cpumaps);
             continue;
         }
 
@@ -147,6 +234,7 @@ int getVcpuInfo(virDomainPtr* domains, int numDomains)
         {
             fprintf(stderr, "Error: Memory allocation failed for CPU stats\n");
             free(vcpuInfoArray);
+            free(cpumaps);
             continue;
         }
 
@@ -155,6 +243,7 @@ int getVcpuInfo(virDomainPtr* domains, int numDomains)
         {
             fprintf(stderr, "Error: Failed to get CPU stats for domain %d\n", i);
             free(vcpuInfoArray);
+            free(cpumaps);
             free(cpuStats);
             continue;
         }
@@ -177,11 +266,27 @@ int getVcpuInfo(virDomainPtr* domains, int numDomains)
             }
             vcpuInfo[vcpuIndex].currentPcpu = vcpuInfoArray[j].cpu;
             vcpuInfo[vcpuIndex].domain = domains[i];
+            vcpuInfo[vcpuIndex].qosClass = qosClass;
+
+            // Record the PCPU the VCPU is pinned to if its affinity allows exactly one
+            vcpuInfo[vcpuIndex].pinnedPcpu = -1;
+            int usable = 0;
+            for (int p = 0; p < numPcpus; p++)
+            {
+                if (VIR_CPU_USABLE(cpumaps, cpumapLen, j, p))
+                {
+                    vcpuInfo[vcpuIndex].pinnedPcpu = p;
+                    usable++;
+                }
+            }
+            if (usable != 1)
+                vcpuInfo[vcpuIndex].pinnedPcpu = -1;
             vcpuIndex++;
         }
 
         // Free the temporary arrays
         free(vcpuInfoArray);
+        free(cpumaps);
         free(cpuStats);
     }
 
@@ -201,6 +306,408 @@ int getNumPcpus(virConnectPtr conn)
     return nodeInfo.cpus;
 }
 
+// Helper function to parse a QoS class name, returns -1 if it is not recognized
+int parseQosClass(const char* name)
+{
+    for (int c = 0; c < QOS_NUM_CLASSES; c++)
+    {
+        if (strcmp(name, qosClassNames[c]) == 0)
+            return c;
+    }
+    return -1;
+}
+
+// Helper function to (re)load the QoS class configuration file, a missing file means no overrides
+void loadQosConfig(const char* path)
+{
+    numQosEntries = 0;
+    FILE* file = fopen(path, "r");
+    if (!file)
+        return;
+
+    char line[512];
+    while (fgets(line, sizeof(line), file) && numQosEntries < MAX_QOS_ENTRIES)
+    {
+        char name[256], className[32];
+        if (line[0] == '#' || sscanf(line, "%255s %31s", name, className) != 2)
+            continue;
+        int qosClass = parseQosClass(className);
+        if (qosClass < 0)
+        {
+            fprintf(stderr, "Error: Unknown QoS class '%s' for domain %s in %s\n", className, name, path);
+            continue;
+        }
+        strcpy(qosConfig[numQosEntries].name, name);
+        qosConfig[numQosEntries].qosClass = (QosClass)qosClass;
+        numQosEntries++;
+    }
+    fclose(file);
+}
+
+// Helper function to print libvirt errors, except missing QoS metadata which just means the domain is shared
+void libvirtErrorHandler(void* userData, virErrorPtr error)
+{
+    if (error->code == VIR_ERR_NO_DOMAIN_METADATA)
+        return;
+    fprintf(stderr, "libvirt: error : %s\n", error->message);
+}
+
+// Helper function to get the QoS class of a domain from the config file, then its metadata, defaulting to shared
+QosClass getQosClass(virDomainPtr domain)
+{
+    const char* name = virDomainGetName(domain);
+    for (int i = 0; name && i < numQosEntries; i++)
+    {
+        if (strcmp(qosConfig[i].name, name) == 0)
+            return qosConfig[i].qosClass;
+    }
+
+    // Set with: virsh metadata <domain> http://aos.project1/qos --key qos --set '<qos class="dedicated"/>'
+    char* metadata = virDomainGetMetadata(domain, VIR_DOMAIN_METADATA_ELEMENT, QOS_METADATA_URI, VIR_DOMAIN_AFFECT_LIVE);
+    if (!metadata)
+    {
+        virResetLastError();
+        return QOS_SHARED;
+    }
+
+    QosClass qosClass = QOS_SHARED;
+    char* attr = strstr(metadata, "class=");
+    if (attr)
+    {
+        char className[32];
+        if (sscanf(attr + strlen("class=") + 1, "%31[a-z]", className) == 1 && parseQosClass(className) >= 0)
+            qosClass = (QosClass)parseQosClass(className);
+    }
+    free(metadata);
+    return qosClass;
+}
+
+// Helper function to get the class a VCPU is scheduled as; dedicated VCPUs without a reserved PCPU are treated as shared
+QosClass effectiveClass(VcpuInfo* vcpu)
+{
+    if (vcpu->qosClass == QOS_DEDICATED && vcpu->dedicatedPcpu < 0)
+        return QOS_SHARED;
+    return vcpu->qosClass;
+}
+
+// Helper function to check whether the first numPcpus bits of two cpumaps match
+int sameAffinity(unsigned char* a, unsigned char* b, int numPcpus)
+{
+    for (int p = 0; p < numPcpus; p++)
+    {
+        if (VIR_CPU_USABLE(a, VIR_CPU_MAPLEN(numPcpus), 0, p) != VIR_CPU_USABLE(b, VIR_CPU_MAPLEN(numPcpus), 0, p))
+            return 0;
+    }
+    return 1;
+}
+
+// Helper function to pin a domain's emulator and I/O threads to the PCPUs in cpumap, if they are not already
+void pinDomainThreads(virDomainPtr domain, unsigned char* cpumap, int numPcpus)
+{
+    int cpumapLen = VIR_CPU_MAPLEN(numPcpus);
+    unsigned char* current = (unsigned char*)calloc(cpumapLen, sizeof(unsigned char));
+    if (!current)
+    {
+        fprintf(stderr, "Error allocating emulator cpumap\n");
+        return;
+    }
+    if (virDomainGetEmulatorPinInfo(domain, current, cpumapLen, VIR_DOMAIN_AFFECT_LIVE) < 0 || !sameAffinity(current, cpumap, numPcpus))
+    {
+        if (virDomainPinEmulator(domain, cpumap, cpumapLen, VIR_DOMAIN_AFFECT_LIVE) < 0)
+            fprintf(stderr, "Error: Failed to pin emulator threads of %s\n", virDomainGetName(domain));
+        else
+            printf("Pinned emulator threads of %s to the shared PCPUs\n", virDomainGetName(domain));
+    }
+    free(current);
+
+    // Domains without I/O threads report none, and hypervisors without them fail; there is nothing to pin either way
+    virDomainIOThreadInfoPtr* iothreads = NULL;
+    int numIOThreads = virDomainGetIOThreadInfo(domain, &iothreads, VIR_DOMAIN_AFFECT_LIVE);
+    if (numIOThreads < 0)
+    {
+        virResetLastError();
+        return;
+    }
+    for (int t = 0; t < numIOThreads; t++)
+    {
+        if (iothreads[t]->cpumaplen < cpumapLen || !sameAffinity(iothreads[t]->cpumap, cpumap, numPcpus))
+        {
+            if (virDomainPinIOThread(domain, iothreads[t]->iothread_id, cpumap, cpumapLen, VIR_DOMAIN_AFFECT_LIVE) < 0)
+                fprintf(stderr, "Error: Failed to pin I/O thread %u of %s\n", iothreads[t]->iothread_id, virDomainGetName(domain));
+            else
+                printf("Pinned I/O thread %u of %s to the shared PCPUs\n", iothreads[t]->iothread_id, virDomainGetName(domain));
+        }
+        virDomainIOThreadInfoFree(iothreads[t]);
+    }
+    free(iothreads);
+}
+
+// Helper function to pin a VCPU to a single PCPU and update the per-PCPU loads
+int moveVcpu(VcpuInfo* vcpu, int pcpu, PcpuLoad* loads, int numPcpus)
+{
+    int from = vcpu->currentPcpu;
+
+    // Prepare cpumap that allows only the target PCPU
+    unsigned int cpumapLen = (numPcpus + 7) / 8;
+    unsigned char* cpumap = (unsigned char*)calloc(cpumapLen, sizeof(unsigned char));
+    if (!cpumap) {
+        fprintf(stderr, "Error allocating cpumap\n");
+        return -1;
+    }
+    cpumap[pcpu / 8] |= (1 << (pcpu % 8));
+
+    int val = virDomainPinVcpu(vcpu->domain, vcpu->vcpuID, cpumap, cpumapLen);
+    free(cpumap);
+    if (val < 0) {
+        fprintf(stderr, "Error: Failed to repin VCPU %d from PCPU %d to PCPU %d\n", vcpu->vcpuID, from, pcpu);
+        return -1;
+    }
+    if (from == pcpu)
+        printf("Pinned %s VCPU %d of %s to PCPU %d (Utilization: %.2f%%)\n",
+            qosClassNames[effectiveClass(vcpu)], vcpu->vcpuID, virDomainGetName(vcpu->domain), pcpu, vcpu->utilization);
+    else
+        printf("Repinned %s VCPU %d of %s from PCPU %d to PCPU %d (Utilization: %.2f%%)\n",
+            qosClassNames[effectiveClass(vcpu)], vcpu->vcpuID, virDomainGetName(vcpu->domain), from, pcpu, vcpu->utilization);
+
+    QosClass c = effectiveClass(vcpu);
+    if (from >= 0 && from < numPcpus) {
+        loads[from].util -= vcpu->utilization;
+        loads[from].count--;
+        loads[from].classUtil[c] -= vcpu->utilization;
+        loads[from].classCount[c]--;
+    }
+    loads[pcpu].util += vcpu->utilization;
+    loads[pcpu].count++;
+    loads[pcpu].classUtil[c] += vcpu->utilization;
+    loads[pcpu].classCount[c]++;
+    vcpu->currentPcpu = pcpu;  // Update the mapping
+    vcpu->pinnedPcpu = pcpu;
+    return 0;
+}
+
+// Helper function to reserve an exclusive PCPU for every dedicated VCPU, keeping at least one PCPU shared
+void assignDedicatedPcpus(VcpuInfo* vcpuInfo, int totalVcpus, PcpuLoad* loads, int numPcpus)
+{
+    int numReserved = 0;
+
+    // Keep reservations that are still valid so dedicated VCPUs are not moved around
+    for (int i = 0; i < totalVcpus; i++)
+    {
+        int p = vcpuInfo[i].dedicatedPcpu;
+        if (vcpuInfo[i].qosClass != QOS_DEDICATED || p < 0 || p >= numPcpus || loads[p].owner != PCPU_SHARED || numReserved >= numPcpus - 1)
+        {
+            vcpuInfo[i].dedicatedPcpu = -1;
+            continue;
+        }
+        loads[p].owner = i;
+        numReserved++;
+    }
+
+    // Reserve a PCPU for each new dedicated VCPU, preferring the one it runs on, then the least loaded one
+    for (int i = 0; i < totalVcpus; i++)
+    {
+        if (vcpuInfo[i].qosClass != QOS_DEDICATED || vcpuInfo[i].dedicatedPcpu >= 0)
+            continue;
+        if (numReserved >= numPcpus - 1)
+        {
+            printf("No PCPU left to dedicate to VCPU %d of %s, scheduling it as shared\n", vcpuInfo[i].vcpuID, virDomainGetName(vcpuInfo[i].domain));
+            continue;
+        }
+        int best = vcpuInfo[i].currentPcpu;
+        if (best < 0 || best >= numPcpus || loads[best].owner != PCPU_SHARED)
+        {
+            best = -1;
+            for (int p = 0; p < numPcpus; p++)
+            {
+                if (loads[p].owner == PCPU_SHARED && (best == -1 || loads[p].util < loads[best].util))
+                    best = p;
+            }
+        }
+        loads[best].owner = i;
+        vcpuInfo[i].dedicatedPcpu = best;
+        numReserved++;
+    }
+}
+
+// Helper function to pick the shared PCPU a batch VCPU should be packed onto: the fullest one it still fits on
+int findBatchPcpu(VcpuInfo* vcpu, PcpuLoad* loads, int numPcpus, int exclude)
+{
+    int best = -1;
+    for (int p = 0; p < numPcpus; p++)
+    {
+        if (p == exclude || loads[p].owner != PCPU_SHARED || loads[p].util + vcpu->utilization > 100.0)
+            continue;
+        if (best == -1 || loads[p].classUtil[QOS_BATCH] > loads[best].classUtil[QOS_BATCH])
+            best = p;
+    }
+    return best;
+}
+
+// Helper function to find the least loaded shared PCPU
+int findLeastLoadedPcpu(PcpuLoad* loads, int numPcpus)
+{
+    int best = -1;
+    for (int p = 0; p < numPcpus; p++)
+    {
+        if (loads[p].owner == PCPU_SHARED && (best == -1 || loads[p].util < loads[best].util))
+            best = p;
+    }
+    return best;
+}
+
+// Helper function to read a single integer from a sysfs file
+int readSysfsValue(const char* path, unsigned long long* value)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+        return -1;
+    int ret = fscanf(file, "%llu", value) == 1 ? 0 : -1;
+    fclose(file);
+    return ret;
+}
+
+// Helper function to report package energy use since the last reading from RAPL, if the host exposes it
+void reportEnergy()
+{
+    for (int d = 0; d < MAX_RAPL_DOMAINS; d++)
+    {
+        char path[128];
+        unsigned long long energy, range;
+        snprintf(path, sizeof(path), RAPL_PATH, d, "energy_uj");
+        if (readSysfsValue(path, &energy) < 0)
+            break;
+        snprintf(path, sizeof(path), RAPL_PATH, d, "max_energy_range_uj");
+        if (readSysfsValue(path, &range) < 0)
+            range = 0;
+        // Readings are one interval plus the scheduler's own run time apart, so measure the actual period
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        double now = ts.tv_sec + ts.tv_nsec / 1e9;
+
+        // First reading only primes the counter
+        if (prevEnergy[d] != 0 && now > prevEnergyTime[d])
+        {
+            // The counter wraps around at max_energy_range_uj
+            unsigned long long used = energy >= prevEnergy[d] ? energy - prevEnergy[d] : energy + range - prevEnergy[d];
+            totalEnergy[d] += used / 1e6;
+            printf("Package %d: %.2f W (%.1f J since start)\n", d, used / 1e6 / (now - prevEnergyTime[d]), totalEnergy[d]);
+        }
+        prevEnergy[d] = energy;
+        prevEnergyTime[d] = now;
+    }
+}
+
+// Helper function to decide which shared PCPUs to use while load is low, parking the rest
+// Enters consolidation below CONSOLIDATE_ENTER_LOAD and leaves it above CONSOLIDATE_EXIT_LOAD so it does not flap
+void parkIdlePcpus(PcpuLoad* loads, int numPcpus)
+{
+    int numShared = 0;
+    double sharedLoad = 0;
+    for (int p = 0; p < numPcpus; p++)
+    {
+        if (loads[p].owner == PCPU_SHARED)
+        {
+            numShared++;
+            sharedLoad += loads[p].util;
+        }
+    }
+    if (numShared == 0)
+        return;
+
+    double loadPercent = sharedLoad / numShared;
+    if (!consolidating && loadPercent < CONSOLIDATE_ENTER_LOAD)
+    {
+        printf("Load %.2f%% of shared capacity, consolidating VCPUs\n", loadPercent);
+        consolidating = 1;
+    }
+    else if (consolidating && loadPercent > CONSOLIDATE_EXIT_LOAD)
+    {
+        printf("Load %.2f%% of shared capacity, spreading VCPUs\n", loadPercent);
+        consolidating = 0;
+    }
+    if (!consolidating)
+    {
+        free(activePcpus);
+        activePcpus = NULL;
+        return;
+    }
+
+    if (!activePcpus || numActiveMapPcpus != numPcpus)
+    {
+        free(activePcpus);
+        activePcpus = (int*)calloc(numPcpus, sizeof(int));
+        if (!activePcpus)
+        {
+            fprintf(stderr, "Error allocating active PCPU map\n");
+            consolidating = 0;
+            return;
+        }
+        numActiveMapPcpus = numPcpus;
+    }
+
+    // PCPUs reserved for dedicated VCPUs since the last interval leave the active set
+    int numCurrent = 0;
+    for (int p = 0; p < numPcpus; p++)
+    {
+        if (loads[p].owner != PCPU_SHARED)
+            activePcpus[p] = 0;
+        numCurrent += activePcpus[p];
+    }
+
+    // Keep just enough PCPUs to carry the load with headroom, growing the set as demand rises.
+    // Only shrink once the load also fits in half of each PCPU's usable share, so a load near the boundary does not flap
+    double capacity = 100.0 - CONSOLIDATE_HEADROOM;
+    int numActive = numCurrent;
+    int numNeeded = (int)ceil(sharedLoad / capacity);
+    int numSpare = (int)ceil(sharedLoad / (capacity - capacity / 2));
+    if (numCurrent == 0 || numNeeded > numCurrent)
+        numActive = numNeeded;
+    else if (numSpare < numCurrent)
+        numActive = numSpare;
+    numActive = MAX(1, MIN(numActive, numShared));
+
+    // The set only changes when its size does, so noisy samples do not shuffle VCPUs between PCPUs.
+    // Grow with the busiest parked PCPUs and shrink by the least loaded active ones, so the fewest VCPUs move
+    for (; numCurrent < numActive; numCurrent++)
+    {
+        int best = -1;
+        for (int p = 0; p < numPcpus; p++)
+        {
+            if (loads[p].owner == PCPU_SHARED && !activePcpus[p] && (best == -1 || loads[p].util > loads[best].util))
+                best = p;
+        }
+        activePcpus[best] = 1;
+    }
+    for (; numCurrent > numActive; numCurrent--)
+    {
+        int worst = -1;
+        for (int p = 0; p < numPcpus; p++)
+        {
+            if (activePcpus[p] && (worst == -1 || loads[p].util < loads[worst].util))
+                worst = p;
+        }
+        activePcpus[worst] = 0;
+    }
+    for (int p = 0; p < numPcpus; p++)
+    {
+        if (loads[p].owner == PCPU_SHARED && !activePcpus[p])
+            loads[p].owner = PCPU_PARKED;
+    }
+}
+
+// Helper function to find the least utilized VCPU of a class on a PCPU, -1 if there is none
+int findSmallestVcpu(VcpuInfo* vcpuInfo, int totalVcpus, int pcpu, QosClass qosClass)
+{
+    int best = -1;
+    for (int i = 0; i < totalVcpus; i++)
+    {
+        if (vcpuInfo[i].currentPcpu == pcpu && effectiveClass(&vcpuInfo[i]) == qosClass &&
+            (best == -1 || vcpuInfo[i].utilization < vcpuInfo[best].utilization))
+            best = i;
+    }
+    return best;
+}
+
 // Helper function to repin CPUs if the usage difference is beyond a certain threshold
 void repinVcpus(virConnectPtr conn, VcpuInfo* vcpuInfo, int totalVcpus, int interval, double threshold) {
     // Calculate utilization for each VCPU as a percentage
@@ -217,84 +724,163 @@ void repinVcpus(virConnectPtr conn, VcpuInfo* vcpuInfo, int totalVcpus, int inte
         return;
     }
 
-    // Aggregate total utilization and count per PCPU
-    double* totalUtil = (double*)calloc(numPcpus, sizeof(double));
-    int* count = (int*)calloc(numPcpus, sizeof(int));
+    PcpuLoad* loads = (PcpuLoad*)calloc(numPcpus, sizeof(PcpuLoad));
+    if (!loads) {
+        fprintf(stderr, "Error allocating PCPU loads\n");
+        return;
+    }
+    for (int p = 0; p < numPcpus; p++)
+        loads[p].owner = PCPU_SHARED;
+
+    // Aggregate total utilization and count per PCPU, then reserve PCPUs for dedicated VCPUs
+    for (int i = 0; i < totalVcpus; i++) {
+        int p = vcpuInfo[i].currentPcpu;
+        if (p >= 0 && p < numPcpus) {
+            loads[p].util += vcpuInfo[i].utilization;
+            loads[p].count++;
+        }
+    }
+    assignDedicatedPcpus(vcpuInfo, totalVcpus, loads, numPcpus);
     for (int i = 0; i < totalVcpus; i++) {
         int p = vcpuInfo[i].currentPcpu;
         if (p >= 0 && p < numPcpus) {
-            totalUtil[p] += vcpuInfo[i].utilization;
-            count[p]++;
+            loads[p].classUtil[effectiveClass(&vcpuInfo[i])] += vcpuInfo[i].utilization;
+            loads[p].classCount[effectiveClass(&vcpuInfo[i])]++;
         }
     }
 
+    // Park idle PCPUs when total load is low enough to pack VCPUs onto fewer of them
+    if (CONSOLIDATE_MODE)
+        parkIdlePcpus(loads, numPcpus);
+
     // Print per-PCPU total utilizations
     printf("PCPU total utilizations:\n");
     for (int i = 0; i < numPcpus; i++) {
-        printf("PCPU %d: %.2f%% (with %d VCPUs)\n", i, totalUtil[i], count[i]);
+        printf("PCPU %d: %.2f%% (with %d VCPUs: %d dedicated, %d shared, %d batch)", i, loads[i].util, loads[i].count,
+            loads[i].classCount[QOS_DEDICATED], loads[i].classCount[QOS_SHARED], loads[i].classCount[QOS_BATCH]);
+        if (loads[i].owner >= 0)
+            printf(" [dedicated to %s VCPU %d]", virDomainGetName(vcpuInfo[loads[i].owner].domain), vcpuInfo[loads[i].owner].vcpuID);
+        else if (loads[i].owner == PCPU_PARKED)
+            printf(" [parked]");
+        char path[128];
+        unsigned long long freq;
+        snprintf(path, sizeof(path), CPUFREQ_PATH, i);
+        if (readSysfsValue(path, &freq) == 0)
+            printf(" @ %llu MHz", freq / 1000);
+        printf("\n");
     }
-
-    // Identify the most loaded and least loaded PCPUs
-    int maxPcpu = 0, minPcpu = 0;
-    for (int i = 1; i < numPcpus; i++) {
-        if (totalUtil[i] > totalUtil[maxPcpu])
-            maxPcpu = i;
-        if (totalUtil[i] < totalUtil[minPcpu])
-            minPcpu = i;
+    reportEnergy();
+
+    // Pin dedicated VCPUs to their PCPU. Once any PCPU is dedicated or parked, every other VCPU must be
+    // pinned to a shared PCPU too: an unpinned VCPU may run anywhere, whatever PCPU it was last sampled on
+    int restricted = 0;
+    for (int p = 0; p < numPcpus; p++) {
+        if (loads[p].owner != PCPU_SHARED)
+            restricted = 1;
+    }
+    int moved = 0;
+    for (int i = 0; i < totalVcpus; i++) {
+        int p = vcpuInfo[i].currentPcpu;
+        int pinned = vcpuInfo[i].pinnedPcpu;
+        if (vcpuInfo[i].dedicatedPcpu >= 0) {
+            if (pinned != vcpuInfo[i].dedicatedPcpu && moveVcpu(&vcpuInfo[i], vcpuInfo[i].dedicatedPcpu, loads, numPcpus) == 0 &&
+                p != vcpuInfo[i].dedicatedPcpu)
+                moved++;
+        }
+        else if (restricted && (pinned < 0 || pinned >= numPcpus || loads[pinned].owner != PCPU_SHARED)) {
+            // Pin in place if the VCPU is already on a shared PCPU, otherwise move it to one
+            int target = -1;
+            if (p >= 0 && p < numPcpus && loads[p].owner == PCPU_SHARED)
+                target = p;
+            if (target == -1 && effectiveClass(&vcpuInfo[i]) == QOS_BATCH)
+                target = findBatchPcpu(&vcpuInfo[i], loads, numPcpus, -1);
+            if (target == -1)
+                target = findLeastLoadedPcpu(loads, numPcpus);
+            if (target != -1 && moveVcpu(&vcpuInfo[i], target, loads, numPcpus) == 0 && target != p)
+                moved++;
+        }
     }
 
-    // If difference between max and min PCPU loads is greater than a certain threshold
-    if (totalUtil[maxPcpu] - totalUtil[minPcpu] > threshold) 
-    {
-        int minVcpu = -1;
-        double lowestVcpuUtil = 100.0;
-
-        // For each VCPU on the most loaded PCPU: Find minimum VCPU to reassign 
-        for (int i = 0; i < totalVcpus; i++) 
-        {
-            if (vcpuInfo[i].currentPcpu == maxPcpu && vcpuInfo[i].utilization < lowestVcpuUtil)
-            {
-                lowestVcpuUtil = vcpuInfo[i].utilization;
-                minVcpu = i; // Smallest VCPU has the smallest impact on memory reallocation and reduces load on PCPU
+    // QEMU's emulator and I/O threads keep the default affinity of every host CPU, so keep those of domains
+    // without a dedicated PCPU on the shared PCPUs too. With nothing reserved or parked this restores all PCPUs
+    unsigned char* sharedMap = (unsigned char*)calloc(VIR_CPU_MAPLEN(numPcpus), sizeof(unsigned char));
+    if (sharedMap) {
+        for (int p = 0; p < numPcpus; p++) {
+            if (loads[p].owner == PCPU_SHARED)
+                VIR_USE_CPU(sharedMap, p);
+        }
+        for (int i = 0; i < totalVcpus; i++) {
+            // Handle each domain once, at its first VCPU, and skip domains that own a dedicated PCPU
+            int first = 1;
+            int dedicated = 0;
+            for (int j = 0; j < totalVcpus; j++) {
+                if (vcpuInfo[j].domain == vcpuInfo[i].domain) {
+                    if (j < i)
+                        first = 0;
+                    if (vcpuInfo[j].dedicatedPcpu >= 0)
+                        dedicated = 1;
+                }
             }
+            if (first && !dedicated)
+                pinDomainThreads(vcpuInfo[i].domain, sharedMap, numPcpus);
         }
+        free(sharedMap);
+    }
+    else
+        fprintf(stderr, "Error allocating shared PCPU map\n");
 
-        // If a minimum VCPU exists
-        if (minVcpu != -1) 
-        {
-            // Prepare cpumap that allows to allow for only min PCPU
-            unsigned int cpumapLen = (numPcpus + 7) / 8;
-            unsigned char* cpumap = (unsigned char*)calloc(cpumapLen, sizeof(unsigned char));
-            if (!cpumap) {
-                fprintf(stderr, "Error allocating cpumap\n");
-                free(totalUtil);
-                free(count);
-                return;
-            }
-            cpumap[minPcpu / 8] |= (1 << (minPcpu % 8));
+    // Let the new placement settle before balancing on top of it
+    if (moved > 0) {
+        free(loads);
+        return;
+    }
 
-            // Repin min VCPU to min PCPU to redistribute
-            int val = virDomainPinVcpu(vcpuInfo[minVcpu].domain, vcpuInfo[minVcpu].vcpuID, cpumap, cpumapLen);
-            if (val < 0) {
-                fprintf(stderr, "Error: Failed to repin VCPU %d from PCPU %d to PCPU %d\n",
-                    vcpuInfo[minVcpu].vcpuID, maxPcpu, minPcpu);
-            }
-            else {
-                printf("Repinned VCPU %d from PCPU %d to PCPU %d (Utilization: %.2f%%)\n",
-                    vcpuInfo[minVcpu].vcpuID, maxPcpu, minPcpu, vcpuInfo[minVcpu].utilization);
-                vcpuInfo[minVcpu].currentPcpu = minPcpu;  // Update the mapping
-            }
-            free(cpumap);
+    // Pack batch VCPUs: move the smallest batch VCPU off the shared PCPU with the least batch load
+    // onto the PCPU with the most batch load it still fits on
+    int batchSrc = -1;
+    for (int p = 0; p < numPcpus; p++) {
+        if (loads[p].owner == PCPU_SHARED && loads[p].classCount[QOS_BATCH] > 0 &&
+            (batchSrc == -1 || loads[p].classUtil[QOS_BATCH] < loads[batchSrc].classUtil[QOS_BATCH]))
+            batchSrc = p;
+    }
+    if (batchSrc != -1) {
+        int batchVcpu = findSmallestVcpu(vcpuInfo, totalVcpus, batchSrc, QOS_BATCH);
+        int target = findBatchPcpu(&vcpuInfo[batchVcpu], loads, numPcpus, batchSrc);
+        // Only move towards a PCPU that already carries at least as much batch load, so packing converges
+        if (target != -1 && loads[target].classUtil[QOS_BATCH] >= loads[batchSrc].classUtil[QOS_BATCH]) {
+            moveVcpu(&vcpuInfo[batchVcpu], target, loads, numPcpus);
+            free(loads);
+            return;
         }
-        else {
-            printf("No suitable candidate found for repinning.\n");
+    }
+
+    // Identify the least loaded shared PCPU and the most loaded shared PCPU that has a shared VCPU worth moving
+    int maxPcpu = -1, minVcpu = -1, imbalanced = 0;
+    int minPcpu = findLeastLoadedPcpu(loads, numPcpus);
+    for (int p = 0; minPcpu != -1 && p < numPcpus; p++) {
+        double gap = loads[p].util - loads[minPcpu].util;
+        // Only consider PCPUs whose difference from the min PCPU is greater than a certain threshold
+        if (loads[p].owner != PCPU_SHARED || loads[p].classCount[QOS_SHARED] == 0 || gap <= threshold)
+            continue;
+        imbalanced = 1;
+
+        // Smallest VCPU has the smallest impact on memory reallocation and reduces load on PCPU,
+        // but moving a VCPU larger than the gap would only swap which PCPU is overloaded
+        int candidate = findSmallestVcpu(vcpuInfo, totalVcpus, p, QOS_SHARED);
+        if (vcpuInfo[candidate].utilization < gap && (maxPcpu == -1 || loads[p].util > loads[maxPcpu].util)) {
+            maxPcpu = p;
+            minVcpu = candidate;
         }
     }
-    else {
+
+    // If a minimum VCPU exists, repin it to min PCPU to redistribute
+    if (minVcpu != -1)
+        moveVcpu(&vcpuInfo[minVcpu], minPcpu, loads, numPcpus);
+    else if (imbalanced)
+        printf("No suitable candidate found for repinning.\n");
+    else
         printf("System is balanced, no repinning needed.\n");
-    }
-    free(totalUtil);
-    free(count);
+    free(loads);
 }
 
 
@@ -313,8 +899,18 @@ void CPUScheduler(virConnectPtr conn, int interval)
         return;
     }
 
+    // Most domains have no QoS metadata, so keep libvirt from printing an error for each lookup
+    if (!errorHandlerInstalled)
+    {
+        virSetErrorFunc(NULL, libvirtErrorHandler);
+        errorHandlerInstalled = 1;
+    }
+
+    // Reload QoS classes so edits to the config file take effect on the next interval
+    loadQosConfig(QOS_CONFIG_FILE);
+
     // Get VCPU information
-    totalVcpus = getVcpuInfo(domains, numDomains); 
+    totalVcpus = getVcpuInfo(domains, numDomains, getNumPcpus(conn)); 
     
     // Run the repinning algorithm.
     repinVcpus(conn, vcpuInfo, totalVcpus, interval, 10);
@@ -6,3 +6,5 @@ do
   cd ${SCRIPT_DIR}/testcases/${i}/
   make
 done
+cd ${SCRIPT_DIR}/workload/
+make
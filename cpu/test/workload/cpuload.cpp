@@ -0,0 +1,297 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+
+/*
+ * cpuload - clock-calibrated CPU load generator.
+ *
+ * Each worker thread runs a fixed slot (-P) in which it spins on
+ * work units for duty% of the slot and sleeps for the rest, so the duty
+ * cycle does not depend on how fast the machine is. The number of work
+ * units completed per second is reported, which gives a ground-truth
+ * measure of how much CPU time the guest actually received.
+ *
+ * Usage: cpuload [-t threads] [-d duty] [-p duty:sec,duty:sec,...]
+ *                [-P period_ms] [-r report_sec] [-c units_per_sec]
+ *   -t  number of worker threads (default 1)
+ *   -d  duty cycle in percent, run forever (default 100)
+ *   -p  phase script, e.g. "100:30,20:30" runs 100% for 30s then 20% for
+ *       30s and exits; overrides -d
+ *   -P  scheduling slot length in milliseconds (default 10)
+ *   -r  report interval in seconds (default 1)
+ *   -c  reference rate of one thread at 100% in units/s, e.g. measured on an
+ *       idle host, instead of calibrating at startup
+ */
+
+#define MAX_THREADS 256
+#define MAX_PHASES 64
+#define UNIT_ITERATIONS 1000 // Inner loop length of one work unit
+#define CHECK_TARGET_NS 20000 // Target time between two clock reads while busy
+#define BURST_TARGET_NS 2000000 // Length of one calibration burst, short enough to fit in a scheduler slice
+#define CALIBRATION_BURSTS 100 // Calibration keeps the fastest of this many bursts
+#define NSEC_PER_SEC 1000000000LL
+#define CACHE_LINE 64
+
+typedef struct {
+    int duty; // Target duty cycle in percent
+    int seconds; // Phase length, -1 means run forever
+} Phase;
+
+// Padded to a cache line so workers never share one
+typedef struct alignas(CACHE_LINE) {
+    pthread_t thread;
+    std::atomic<unsigned long long> units; // Work units completed so far
+    volatile unsigned long long sink; // Result of the work loop, keeps it from being optimized out
+} Worker;
+
+static Phase phases[MAX_PHASES];
+static int numPhases = 0;
+static Worker workers[MAX_THREADS];
+static int numThreads = 1;
+static long long periodNs = 10 * 1000000LL;
+static std::atomic<int> currentDuty(100);
+static std::atomic<int> stop(0);
+static int unitsPerCheck = 1; // Work units done between two clock reads
+static double calibratedRate = 0; // Units per second of one thread at 100% on an idle CPU
+static volatile unsigned long long calibrationSink; // Result of the calibration loop
+
+static long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void sleepUntil(long long deadline)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline / NSEC_PER_SEC;
+    ts.tv_nsec = deadline % NSEC_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+// One work unit: a short integer hash loop with a fixed instruction count
+static inline unsigned long long doWorkUnit(unsigned long long x)
+{
+    for (int i = 0; i < UNIT_ITERATIONS; i++)
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    return x;
+}
+
+// Set how many work units busy loops do between clock reads, so they read the clock at a fixed rate
+static void setReference(double nsPerUnit)
+{
+    unitsPerCheck = (int)(CHECK_TARGET_NS / nsPerUnit);
+    if (unitsPerCheck < 1)
+        unitsPerCheck = 1;
+    calibratedRate = NSEC_PER_SEC / nsPerUnit;
+}
+
+// Measure how long a work unit takes on an uncontended CPU.
+// The VMs start their workloads together on shared PCPUs, so a single long run would be slowed down by the
+// very contention it is the reference for. Short bursts usually fit in one scheduler slice, and the fastest
+// of many is the one that was not preempted.
+static void calibrate()
+{
+    int units = 1;
+    long long elapsed = 0;
+    unsigned long long x = 1;
+    // Double the burst until it runs for about BURST_TARGET_NS
+    while (elapsed < BURST_TARGET_NS / 2) {
+        units *= 2;
+        long long start = nowNs();
+        for (int i = 0; i < units; i++)
+            x = doWorkUnit(x);
+        elapsed = nowNs() - start;
+    }
+
+    double best = (double)elapsed / units;
+    for (int b = 0; b < CALIBRATION_BURSTS; b++) {
+        // Sleep between bursts so each one starts on a fresh slice
+        sleepUntil(nowNs() + BURST_TARGET_NS / 2);
+        long long start = nowNs();
+        for (int i = 0; i < units; i++)
+            x = doWorkUnit(x);
+        double nsPerUnit = (double)(nowNs() - start) / units;
+        if (nsPerUnit < best)
+            best = nsPerUnit;
+    }
+    calibrationSink = x;
+    setReference(best);
+}
+
+static void* workerMain(void* arg)
+{
+    Worker* w = (Worker*)arg;
+    long long slotStart = nowNs();
+    unsigned long long x = (unsigned long long)(w - workers) + 1; // Thread-local accumulator
+
+    while (!stop.load(std::memory_order_relaxed)) {
+        long long busyEnd = slotStart + periodNs * currentDuty.load(std::memory_order_relaxed) / 100;
+        unsigned long long done = 0;
+
+        // Spin until this slot's busy share is used up
+        while (nowNs() < busyEnd) {
+            for (int i = 0; i < unitsPerCheck; i++)
+                x = doWorkUnit(x);
+            done += unitsPerCheck;
+        }
+        w->units.fetch_add(done, std::memory_order_relaxed);
+        w->sink = x;
+
+        slotStart += periodNs;
+        long long now = nowNs();
+        // If we were descheduled past whole slots, resynchronize instead of bursting to catch up
+        if (now > slotStart + periodNs)
+            slotStart = now;
+        else if (slotStart > now)
+            sleepUntil(slotStart);
+    }
+    return NULL;
+}
+
+// Parse "duty:sec,duty:sec,..." into the phase table
+static int parsePhases(const char* script)
+{
+    char* copy = strdup(script);
+    char* save = NULL;
+    numPhases = 0;
+    for (char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int duty, seconds;
+        if (numPhases >= MAX_PHASES || sscanf(tok, "%d:%d", &duty, &seconds) != 2 ||
+            duty < 0 || duty > 100 || seconds <= 0) {
+            fprintf(stderr, "Invalid phase '%s' (expected duty:seconds)\n", tok);
+            free(copy);
+            return -1;
+        }
+        phases[numPhases].duty = duty;
+        phases[numPhases].seconds = seconds;
+        numPhases++;
+    }
+    free(copy);
+    return numPhases > 0 ? 0 : -1;
+}
+
+static unsigned long long totalUnits(unsigned long long* perThread)
+{
+    unsigned long long total = 0;
+    for (int i = 0; i < numThreads; i++) {
+        perThread[i] = workers[i].units.load(std::memory_order_relaxed);
+        total += perThread[i];
+    }
+    return total;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-d duty] [-p duty:sec,...] [-P period_ms] [-r report_sec] [-c units_per_sec]\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+    int duty = 100;
+    int reportSec = 1;
+    double referenceRate = 0;
+    const char* script = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:d:p:P:r:c:h")) != -1) {
+        switch (opt) {
+        case 't': numThreads = atoi(optarg); break;
+        case 'd': duty = atoi(optarg); break;
+        case 'p': script = optarg; break;
+        case 'P': periodNs = atoll(optarg) * 1000000LL; break;
+        case 'r': reportSec = atoi(optarg); break;
+        case 'c': referenceRate = atof(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (numThreads < 1 || numThreads > MAX_THREADS || duty < 0 || duty > 100 || periodNs <= 0 || reportSec < 1 || referenceRate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (script) {
+        if (parsePhases(script) < 0)
+            return 1;
+    }
+    else {
+        phases[0].duty = duty;
+        phases[0].seconds = -1;
+        numPhases = 1;
+    }
+
+    if (referenceRate > 0) {
+        setReference(NSEC_PER_SEC / referenceRate);
+        printf("Reference: %.0f units/s per thread at 100%% (given), %d units per clock check\n", calibratedRate, unitsPerCheck);
+    }
+    else {
+        calibrate();
+        printf("Calibrated: %.0f units/s per thread at 100%%, %d units per clock check\n", calibratedRate, unitsPerCheck);
+    }
+    fflush(stdout);
+
+    currentDuty = phases[0].duty;
+    for (int i = 0; i < numThreads; i++) {
+        workers[i].units = 0;
+        if (pthread_create(&workers[i].thread, NULL, workerMain, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to create worker thread %d\n", i);
+            return 1;
+        }
+    }
+
+    unsigned long long prevPerThread[MAX_THREADS] = {0};
+    unsigned long long perThread[MAX_THREADS];
+    long long start = nowNs();
+    long long tick = start;
+
+    for (int p = 0; p < numPhases; p++) {
+        currentDuty = phases[p].duty;
+        // Phases are laid out back to back on the report clock so reports never drift
+        long long phaseStart = tick;
+        long long phaseEnd = phases[p].seconds < 0 ? -1 : phaseStart + phases[p].seconds * NSEC_PER_SEC;
+        unsigned long long phaseStartUnits = totalUnits(perThread);
+        // Throughput the guest would get if every thread received its full duty share
+        double expectedRate = calibratedRate * numThreads * phases[p].duty / 100.0;
+
+        printf("Phase %d: duty %d%%, %d threads, %d s\n", p, phases[p].duty, numThreads, phases[p].seconds);
+        while (phaseEnd < 0 || tick < phaseEnd) {
+            long long lastTick = tick;
+            tick += reportSec * NSEC_PER_SEC;
+            if (phaseEnd >= 0 && tick > phaseEnd)
+                tick = phaseEnd;
+            sleepUntil(tick);
+
+            // Sum per-thread progress since the last report
+            unsigned long long delta = 0;
+            totalUnits(perThread);
+            for (int i = 0; i < numThreads; i++) {
+                delta += perThread[i] - prevPerThread[i];
+                prevPerThread[i] = perThread[i];
+            }
+            double rate = delta / ((tick - lastTick) / 1e9);
+            printf("[%7.1f s] phase %d duty %3d%% | %12.0f units/s | %5.1f%% of expected\n",
+                   (tick - start) / 1e9, p, phases[p].duty, rate,
+                   expectedRate > 0 ? 100.0 * rate / expectedRate : 0.0);
+            fflush(stdout);
+        }
+
+        unsigned long long phaseUnits = totalUnits(perThread) - phaseStartUnits;
+        double phaseSeconds = (tick - phaseStart) / 1e9;
+        double phaseRate = phaseUnits / phaseSeconds;
+        printf("Phase %d summary: %llu units in %.1f s, %.0f units/s (%.1f%% of expected)\n", p,
+               phaseUnits, phaseSeconds, phaseRate,
+               expectedRate > 0 ? 100.0 * phaseRate / expectedRate : 0.0);
+        fflush(stdout);
+    }
+
+    stop = 1;
+    for (int i = 0; i < numThreads; i++)
+        pthread_join(workers[i].thread, NULL);
+    return 0;
+}
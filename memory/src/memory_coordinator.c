@@ -9,24 +9,43 @@
 #define MIN(a, b) ((a) < (b) ? a : b)
 #define MAX(a, b) ((a) > (b) ? a : b)
 
+// Balloon actuation tuning, override at build time with -D (e.g. make CFLAGS=-DBALLOON_MAX_RATE_MB=32)
+#ifndef BALLOON_DEADBAND_KB
+#define BALLOON_DEADBAND_KB (16 * 1024) // Skip balloon changes smaller than this
+#endif
+#ifndef BALLOON_MAX_RATE_MB
+#define BALLOON_MAX_RATE_MB 64 // Maximum balloon movement per guest in MB per second
+#endif
+#ifndef BALLOON_TOLERANCE_KB
+#define BALLOON_TOLERANCE_KB (4 * 1024) // Balloon has converged once it is this close to its target
+#endif
+#ifndef BALLOON_MAX_PENDING_TICKS
+#define BALLOON_MAX_PENDING_TICKS 5 // Stop waiting on a target the guest has not reached after this many ticks
+#endif
+
 int is_exit = 0; // DO NOT MODIFY THE VARIABLE
 
 void MemoryScheduler(virConnectPtr conn, int interval);
 int enableMemoryStats(virDomainPtr* domains, int numDomains, int period);
 int getMemoryStats(virDomainPtr* domains, int numDomains);
 void getHostMemoryStats(virConnectPtr conn, unsigned long* totalMemory, unsigned long* freeMemory);
-void reallocateMemory(virConnectPtr conn, virDomainPtr* domains, int numDomains, unsigned long totalHostMemory, unsigned long freeHostMemory);
+void reallocateMemory(virConnectPtr conn, virDomainPtr* domains, int numDomains, unsigned long totalHostMemory, unsigned long freeHostMemory, int interval);
 
 // Define a struct to store only the necessary memory stats in KB
 typedef struct {
 	virDomainPtr domain; // Domain of VM
+	unsigned char uuid[VIR_UUID_BUFLEN]; // UUID of the domain, used to find its entry again on the next check
 	unsigned long currentMem; // Current memory that VM is using
 	unsigned long unused; // Unused memory allocated to VM
 	unsigned long prevUnused; // Unused memory from previous check
 	unsigned long maxMem; // Total maximum memory the VM can have
+	unsigned long actual; // Current balloon size reported by the guest
+	unsigned long target; // Last balloon size requested, 0 if none is outstanding
+	int pendingTicks; // Number of checks the outstanding target has not been reached
 } MemoryStats;
 
 MemoryStats* domainMemoryStats = NULL; // Global array to store memory stats for all domains
+int numDomainStats = 0; // Number of entries in domainMemoryStats
 
 
 /*
@@ -93,23 +112,34 @@ int enableMemoryStats(virDomainPtr* domains,int numDomains, int period)
 int getMemoryStats(virDomainPtr* domains, int numDomains) 
 {
 
-	// Allocate memory for the stats array if not already allocated
-	if (domainMemoryStats == NULL) 
+	// Rebuild the stats array in the order of this check's domain list, all values 0 for new domains
+	MemoryStats* newStats = calloc(MAX(numDomains, 1), sizeof(MemoryStats));
+	if (!newStats) 
 	{
-		domainMemoryStats = malloc(numDomains * sizeof(MemoryStats));
-		if (!domainMemoryStats) 
+		fprintf(stderr, "Error: Memory allocation failed for domain memory stats\n");
+		return -1;
+	}
+	// Carry each domain's state over by UUID, so a VM that starts, stops or moves in the list does not
+	// inherit another VM's unused history or outstanding balloon target
+	for (int i = 0; i < numDomains; i++)
+	{
+		if (virDomainGetUUID(domains[i], newStats[i].uuid) < 0)
 		{
-			fprintf(stderr, "Error: Memory allocation failed for domain memory stats\n");
-			return -1;
+			fprintf(stderr, "Error: Failed to get UUID for domain %d\n", i);
+			continue;
 		}
-		// Initialize all values to 0 for the first run
-		for (int i = 0; i < numDomains; i++) {
-			domainMemoryStats[i].prevUnused = 0;
-			domainMemoryStats[i].unused = 0;  
-			domainMemoryStats[i].currentMem = 0;
-			domainMemoryStats[i].maxMem = 0;
+		for (int j = 0; j < numDomainStats; j++)
+		{
+			if (memcmp(domainMemoryStats[j].uuid, newStats[i].uuid, VIR_UUID_BUFLEN) == 0)
+			{
+				newStats[i] = domainMemoryStats[j];
+				break;
+			}
 		}
 	}
+	free(domainMemoryStats);
+	domainMemoryStats = newStats;
+	numDomainStats = numDomains;
 
 	// Allocate temporary array for raw stats
 	virDomainMemoryStatStruct stats[VIR_DOMAIN_MEMORY_STAT_NR];
@@ -138,6 +168,9 @@ int getMemoryStats(virDomainPtr* domains, int numDomains)
 				case VIR_DOMAIN_MEMORY_STAT_RSS:
 					domainMemoryStats[i].currentMem = stats[j].val;
 					break;
+				case VIR_DOMAIN_MEMORY_STAT_ACTUAL_BALLOON:
+					domainMemoryStats[i].actual = stats[j].val;
+					break;
 				default:
 					break; // Ignore other stats
 			}
@@ -199,8 +232,69 @@ void getHostMemoryStats(virConnectPtr conn, unsigned long* totalMemory, unsigned
 	free(stats);
 }
 
+// Helper Function: Check whether the balloon is still moving towards the last requested target
+int balloonConverging(MemoryStats* VMstats, int i)
+{
+	if (VMstats->target == 0)
+		return 0;
+
+	unsigned long distance = VMstats->actual > VMstats->target ? VMstats->actual - VMstats->target : VMstats->target - VMstats->actual;
+	if (distance <= BALLOON_TOLERANCE_KB)
+	{
+		VMstats->target = 0;
+		VMstats->pendingTicks = 0;
+		return 0;
+	}
+
+	// Guest may be unable to reach the target (e.g. it cannot free enough pages), so do not wait forever
+	if (++VMstats->pendingTicks > BALLOON_MAX_PENDING_TICKS)
+	{
+		printf("Domain %d balloon stuck at %lu KB (target %lu KB), accepting current size\n", i, VMstats->actual, VMstats->target);
+		VMstats->target = 0;
+		VMstats->pendingTicks = 0;
+		return 0;
+	}
+
+	printf("Domain %d balloon still converging (actual %lu KB, target %lu KB)\n", i, VMstats->actual, VMstats->target);
+	return 1;
+}
+
+// Helper Function: Get the memory size that balloon changes are measured from
+unsigned long balloonBaseline(MemoryStats* VMstats)
+{
+	// Without a balloon report fall back to the RSS of the VM
+	return VMstats->actual != 0 ? VMstats->actual : VMstats->currentMem;
+}
+
+// Helper Function: Request a new balloon size, applying the deadband and the per-guest rate limit
+// direction is 1 to grow and -1 to shrink; a request that would move the other way is skipped
+// Returns 1 if a request was made, 0 if it was skipped and -1 on failure
+int setBalloonTarget(virDomainPtr domain, MemoryStats* VMstats, unsigned long newMemory, int direction, int interval)
+{
+	unsigned long actual = balloonBaseline(VMstats);
+	unsigned long maxStep = (unsigned long)BALLOON_MAX_RATE_MB * 1024 * MAX(interval, 1);
+
+	if ((direction > 0 && newMemory <= actual) || (direction < 0 && newMemory >= actual))
+		return 0;
+
+	unsigned long delta = newMemory > actual ? newMemory - actual : actual - newMemory;
+	if (delta < BALLOON_DEADBAND_KB)
+		return 0;
+
+	// Move at most maxStep per interval so the balloon driver and host page allocator are not flooded
+	if (delta > maxStep)
+		newMemory = newMemory > actual ? actual + maxStep : actual - maxStep;
+
+	if (virDomainSetMemory(domain, newMemory) < 0)
+		return -1;
+
+	VMstats->target = newMemory;
+	VMstats->pendingTicks = 0;
+	return 1;
+}
+
 // Function to dynamically reallocate memory for domains
-void reallocateMemory(virConnectPtr conn, virDomainPtr* domains, int numDomains, unsigned long totalHostMemory, unsigned long freeHostMemory)
+void reallocateMemory(virConnectPtr conn, virDomainPtr* domains, int numDomains, unsigned long totalHostMemory, unsigned long freeHostMemory, int interval)
 {
 	float hostFreeRatio = (float)freeHostMemory / (float)totalHostMemory;
 	const unsigned long MIN_VM_MEMORY = 100 * 1024;
@@ -212,7 +306,14 @@ void reallocateMemory(virConnectPtr conn, virDomainPtr* domains, int numDomains,
 	{
 		virDomainPtr domain = domains[i];
 		MemoryStats VMstats = domainMemoryStats[i];
-		unsigned long currentMem = VMstats.currentMem;
+		int ret;
+
+		// Do not stack a new request on top of one the balloon driver is still carrying out
+		if (balloonConverging(&domainMemoryStats[i], i))
+			continue;
+
+		// Size changes from the current balloon size, the same baseline setBalloonTarget measures against
+		unsigned long currentMem = balloonBaseline(&domainMemoryStats[i]);
 
 		// Check if unused memory is decreasing
 		int decreasingUnused = (VMstats.unused < VMstats.prevUnused);
@@ -230,8 +331,11 @@ void reallocateMemory(virConnectPtr conn, virDomainPtr* domains, int numDomains,
 					newMemory = maxMemory; 
 
 				// Allocate memory back to VM
-				if (virDomainSetMemory(domain, newMemory) == 0)
-					printf("Increased memory for domain %d to %lu KB\n", i, newMemory);
+				ret = setBalloonTarget(domain, &domainMemoryStats[i], newMemory, 1, interval);
+				if (ret > 0)
+					printf("Increased memory for domain %d to %lu KB\n", i, domainMemoryStats[i].target);
+				else if (ret == 0)
+					printf("Domain %d is at its limit or within the balloon deadband. No need to reallocate\n", i);
 				else
 					fprintf(stderr, "Failed to increase memory for domain %d\n", i);
 			}
@@ -240,8 +344,11 @@ void reallocateMemory(virConnectPtr conn, virDomainPtr* domains, int numDomains,
 		else if (VMstats.unused >= MIN_VM_MEMORY * 1.5 && !decreasingUnused && hostFreeRatio < MEMORY_RATIO)
 		{
 			newMemory = currentMem * (1 - MEMORY_RATIO);
-			if (virDomainSetMemory(domain, newMemory) == 0)
-				printf("Decreased memory for domain %d to %lu KB\n", i, newMemory);
+			ret = setBalloonTarget(domain, &domainMemoryStats[i], newMemory, -1, interval);
+			if (ret > 0)
+				printf("Decreased memory for domain %d to %lu KB\n", i, domainMemoryStats[i].target);
+			else if (ret == 0)
+				printf("Domain %d is at its limit or within the balloon deadband. No need to reallocate\n", i);
 			else
 				fprintf(stderr, "Failed to decrease memory for domain %d\n", i);
 		}
@@ -281,7 +388,7 @@ void MemoryScheduler(virConnectPtr conn, int interval)
 	getHostMemoryStats(conn, &totalHostMemory, &freeHostMemory);
 
 	// Call to reallocate memory
-	reallocateMemory(conn, domains, numDomains, totalHostMemory, freeHostMemory);
+	reallocateMemory(conn, domains, numDomains, totalHostMemory, freeHostMemory, interval);
 
 	free(domains);
 }
\ No newline at end of file
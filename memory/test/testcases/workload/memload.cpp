@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * memload - phased memory workload generator.
+ *
+ * Reserves one large anonymous mapping up front and moves its resident
+ * size through a phase script at a fixed rate, so memory grows without the
+ * realloc copying of the old test cases and can also be handed back to the
+ * guest kernel. In between, it keeps a working set hot with a sequential,
+ * random or hot/cold access pattern. Every page touch is timed, and the
+ * latency percentiles of first touches (page faults) and re-touches are
+ * reported, which shows how much the guest stalls while the balloon moves.
+ *
+ * Usage: memload [-m max_mb] [-p phases] [-w ws_mb] [-a seq|rand|hotcold]
+ *                [-A pages_per_sec] [-r report_sec]
+ *   -m  size of the reserved mapping in MB (default 2048)
+ *   -p  phase script (default "grow:2048:40,hold:30,shrink:0:100"):
+ *         grow:<mb>:<mb_per_sec>    fault in pages up to <mb> resident
+ *         hold:<sec>                keep the working set hot for <sec>
+ *         shrink:<mb>:<mb_per_sec>  release pages down to <mb> resident
+ *   -w  working set in MB, the first part of the resident memory that is
+ *       re-accessed (default 0 = everything resident)
+ *   -a  access pattern over the working set (default seq)
+ *   -A  working set page accesses per second (default 20000, 0 = none)
+ *   -r  report interval in seconds (default 1)
+ */
+
+#define MB (1024L * 1024L)
+#define MAX_PHASES 64
+#define STEP_NS 10000000LL // Length of one pacing step
+#define NSEC_PER_SEC 1000000000LL
+#define CACHE_LINE 64
+#define HOT_FRACTION 10 // Percent of the working set that is hot in hotcold mode
+#define HOT_ACCESS 90 // Percent of accesses that go to the hot part
+#define HIST_SUB_BITS 4 // Linear sub-buckets per power of two in the latency histogram
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+typedef enum { PHASE_GROW, PHASE_HOLD, PHASE_SHRINK } PhaseType;
+typedef enum { ACCESS_SEQ, ACCESS_RAND, ACCESS_HOTCOLD } AccessPattern;
+
+typedef struct {
+    PhaseType type;
+    long targetPages; // Resident size to reach (grow/shrink)
+    double pagesPerSec; // Growth or release rate (grow/shrink)
+    int seconds; // Phase length (hold)
+} Phase;
+
+// Log-linear latency histogram in nanoseconds
+typedef struct {
+    unsigned long long buckets[HIST_BUCKETS];
+    unsigned long long count;
+    unsigned long long max;
+} Histogram;
+
+static Phase phases[MAX_PHASES];
+static int numPhases = 0;
+static long pageSize;
+static char* region = NULL;
+static long maxPages;
+static long residentPages = 0; // Pages [0, residentPages) are faulted in
+static AccessPattern pattern = ACCESS_SEQ;
+static long wsPagesLimit = 0; // 0 means the whole resident set
+static long seqCursor = 0;
+static unsigned long long rngState = 88172645463325252ULL;
+
+static Histogram faultHist, touchHist; // Current report interval
+static Histogram phaseFaultHist, phaseTouchHist; // Current phase
+
+static long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void sleepUntil(long long deadline)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline / NSEC_PER_SEC;
+    ts.tv_nsec = deadline % NSEC_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+static unsigned long long nextRandom()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState;
+}
+
+static int histIndex(unsigned long long v)
+{
+    if (v < (1ULL << HIST_SUB_BITS))
+        return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int sub = (int)((v >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+// Lowest value that maps to bucket idx
+static unsigned long long histValue(int idx)
+{
+    if (idx < (1 << HIST_SUB_BITS))
+        return idx;
+    int msb = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    unsigned long long sub = idx & ((1 << HIST_SUB_BITS) - 1);
+    return ((1ULL << HIST_SUB_BITS) + sub) << (msb - HIST_SUB_BITS);
+}
+
+static void histAdd(Histogram* h, unsigned long long v)
+{
+    h->buckets[histIndex(v)]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static unsigned long long histPercentile(const Histogram* h, double pct)
+{
+    if (h->count == 0)
+        return 0;
+    unsigned long long rank = (unsigned long long)(h->count * pct / 100.0);
+    unsigned long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return histValue(i + 1) < h->max ? histValue(i + 1) : h->max;
+    }
+    return h->max;
+}
+
+static void histPrint(const char* label, const Histogram* h)
+{
+    printf(" | %s %8llu p50 %7.1f p99 %7.1f p99.9 %7.1f max %8.1f us", label, h->count,
+           histPercentile(h, 50) / 1e3, histPercentile(h, 99) / 1e3,
+           histPercentile(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+// Fault in the next page by writing all of it
+static void faultPage()
+{
+    char* page = region + residentPages * pageSize;
+    long long start = nowNs();
+    memset(page, (int)(residentPages & 0xff) | 1, pageSize);
+    unsigned long long ns = nowNs() - start;
+    histAdd(&faultHist, ns);
+    histAdd(&phaseFaultHist, ns);
+    residentPages++;
+}
+
+// Give the last count resident pages back to the guest kernel
+static int releasePages(long count)
+{
+    if (count > residentPages)
+        count = residentPages;
+    if (count <= 0)
+        return 0;
+    if (madvise(region + (residentPages - count) * pageSize, count * pageSize, MADV_DONTNEED) != 0) {
+        perror("madvise");
+        return -1;
+    }
+    residentPages -= count;
+    if (seqCursor >= residentPages)
+        seqCursor = 0;
+    return 0;
+}
+
+// Re-access one working set page, writing a word in every cache line
+static void touchPage()
+{
+    long wsPages = wsPagesLimit > 0 && wsPagesLimit < residentPages ? wsPagesLimit : residentPages;
+    if (wsPages == 0)
+        return;
+
+    long idx;
+    switch (pattern) {
+    case ACCESS_SEQ:
+        idx = seqCursor++ % wsPages;
+        seqCursor %= wsPages;
+        break;
+    case ACCESS_RAND:
+        idx = (long)(nextRandom() % wsPages);
+        break;
+    default: {
+        long hotPages = wsPages * HOT_FRACTION / 100;
+        if (hotPages < 1)
+            hotPages = 1;
+        if ((long)(nextRandom() % 100) < HOT_ACCESS || hotPages == wsPages)
+            idx = (long)(nextRandom() % hotPages);
+        else
+            idx = hotPages + (long)(nextRandom() % (wsPages - hotPages));
+        break;
+    }
+    }
+
+    volatile long* page = (volatile long*)(region + idx * pageSize);
+    long long start = nowNs();
+    for (long off = 0; off < pageSize / (long)sizeof(long); off += CACHE_LINE / sizeof(long))
+        page[off]++;
+    unsigned long long ns = nowNs() - start;
+    histAdd(&touchHist, ns);
+    histAdd(&phaseTouchHist, ns);
+}
+
+// Print the current report interval's line and start a new interval
+static void printReport(long long now, long long start, int p)
+{
+    printf("[%7.1f s] phase %d resident %6ld MB ws %6ld MB", (now - start) / 1e9, p,
+           residentPages * pageSize / MB,
+           (wsPagesLimit > 0 && wsPagesLimit < residentPages ? wsPagesLimit : residentPages) * pageSize / MB);
+    histPrint("faults", &faultHist);
+    histPrint("touches", &touchHist);
+    printf("\n");
+    fflush(stdout);
+    memset(&faultHist, 0, sizeof(Histogram));
+    memset(&touchHist, 0, sizeof(Histogram));
+}
+
+// Parse "grow:mb:rate,hold:sec,shrink:mb:rate,..." into the phase table
+static int parsePhases(const char* script)
+{
+    char* copy = strdup(script);
+    char* save = NULL;
+    numPhases = 0;
+    for (char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        Phase* ph = &phases[numPhases];
+        char name[16];
+        long mb = 0;
+        double rate = 0;
+        int seconds = 0;
+        int ok = numPhases < MAX_PHASES && sscanf(tok, "%15[a-z]", name) == 1;
+        if (ok && strcmp(name, "hold") == 0) {
+            ok = sscanf(tok, "hold:%d", &seconds) == 1 && seconds > 0;
+            ph->type = PHASE_HOLD;
+            ph->seconds = seconds;
+        }
+        else if (ok && (strcmp(name, "grow") == 0 || strcmp(name, "shrink") == 0)) {
+            ok = sscanf(tok + strlen(name), ":%ld:%lf", &mb, &rate) == 2 && mb >= 0 && rate > 0;
+            ph->type = name[0] == 'g' ? PHASE_GROW : PHASE_SHRINK;
+            ph->targetPages = mb * MB / pageSize;
+            ph->pagesPerSec = rate * MB / pageSize;
+        }
+        else
+            ok = 0;
+
+        if (!ok) {
+            fprintf(stderr, "Invalid phase '%s'\n", tok);
+            free(copy);
+            return -1;
+        }
+        if (ph->type != PHASE_HOLD && ph->targetPages > maxPages) {
+            fprintf(stderr, "Phase '%s' exceeds the %ld MB reservation\n", tok, maxPages * pageSize / MB);
+            free(copy);
+            return -1;
+        }
+        numPhases++;
+    }
+    free(copy);
+    return numPhases > 0 ? 0 : -1;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-m max_mb] [-p phases] [-w ws_mb] [-a seq|rand|hotcold] [-A pages_per_sec] [-r report_sec]\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+    long maxMb = 2048;
+    const char* script = "grow:2048:40,hold:30,shrink:0:100";
+    long wsMb = 0;
+    double accessRate = 20000;
+    int reportSec = 1;
+    int opt;
+
+    pageSize = sysconf(_SC_PAGESIZE);
+
+    while ((opt = getopt(argc, argv, "m:p:w:a:A:r:h")) != -1) {
+        switch (opt) {
+        case 'm': maxMb = atol(optarg); break;
+        case 'p': script = optarg; break;
+        case 'w': wsMb = atol(optarg); break;
+        case 'a':
+            if (strcasecmp(optarg, "seq") == 0)
+                pattern = ACCESS_SEQ;
+            else if (strcasecmp(optarg, "rand") == 0)
+                pattern = ACCESS_RAND;
+            else if (strcasecmp(optarg, "hotcold") == 0)
+                pattern = ACCESS_HOTCOLD;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'A': accessRate = atof(optarg); break;
+        case 'r': reportSec = atoi(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (maxMb <= 0 || wsMb < 0 || accessRate < 0 || reportSec < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    maxPages = maxMb * MB / pageSize;
+    wsPagesLimit = wsMb * MB / pageSize;
+    if (parsePhases(script) < 0)
+        return 1;
+
+    // Reserve address space only; pages are faulted in by the phases
+    region = (char*)mmap(NULL, maxPages * pageSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    long long start = nowNs();
+    long long nextReport = start + reportSec * NSEC_PER_SEC;
+    long long step = start;
+    double accessCredit = 0;
+
+    for (int p = 0; p < numPhases; p++) {
+        Phase* ph = &phases[p];
+        long long phaseStart = step;
+        long long paceStart = phaseStart; // Start of the rate line, moved forward by stalls
+        long startPages = residentPages;
+        memset(&phaseFaultHist, 0, sizeof(Histogram));
+        memset(&phaseTouchHist, 0, sizeof(Histogram));
+
+        if (ph->type == PHASE_HOLD)
+            printf("Phase %d: hold for %d s\n", p, ph->seconds);
+        else
+            printf("Phase %d: %s to %ld MB at %.0f MB/s\n", p, ph->type == PHASE_GROW ? "grow" : "shrink",
+                   ph->targetPages * pageSize / MB, ph->pagesPerSec * pageSize / MB);
+        fflush(stdout);
+
+        while (1) {
+            step += STEP_NS;
+            double elapsed = (step - phaseStart) / 1e9;
+            double paced = (step - paceStart) / 1e9;
+
+            // Move the resident size along the phase's rate line
+            if (ph->type == PHASE_GROW) {
+                long want = startPages + (long)(ph->pagesPerSec * paced);
+                if (want > ph->targetPages)
+                    want = ph->targetPages;
+                while (residentPages < want)
+                    faultPage();
+            }
+            else if (ph->type == PHASE_SHRINK) {
+                long want = startPages - (long)(ph->pagesPerSec * paced);
+                if (want < ph->targetPages)
+                    want = ph->targetPages;
+                if (residentPages > want && releasePages(residentPages - want) < 0)
+                    return 1;
+            }
+
+            // Spend the access budget for this step on the working set
+            accessCredit += accessRate * STEP_NS / NSEC_PER_SEC;
+            while (accessCredit >= 1) {
+                touchPage();
+                accessCredit -= 1;
+            }
+
+            long long now = nowNs();
+            if (now >= nextReport) {
+                printReport(now, start, p);
+                // Skip report times missed during a stall instead of printing them back to back
+                while (nextReport <= now)
+                    nextReport += reportSec * NSEC_PER_SEC;
+            }
+
+            // A grow or shrink that starts past its target has nothing to do
+            if (ph->type == PHASE_HOLD ? elapsed >= ph->seconds
+                : ph->type == PHASE_GROW ? residentPages >= ph->targetPages
+                : residentPages <= ph->targetPages)
+                break;
+
+            // Fell behind (e.g. stalled on faults): resynchronize rather than burst, shifting the rate line
+            // by the stall so the missed pages are not all faulted in on the next step
+            if (now > step + STEP_NS) {
+                paceStart += now - step;
+                step = now;
+            }
+            else
+                sleepUntil(step);
+        }
+
+        // Report the rest of the interval now, so the next phase's first report only holds its own samples
+        if (faultHist.count > 0 || touchHist.count > 0)
+            printReport(nowNs(), start, p);
+        printf("Phase %d summary: %.1f s, resident %ld MB", p, (step - phaseStart) / 1e9, residentPages * pageSize / MB);
+        histPrint("faults", &phaseFaultHist);
+        histPrint("touches", &phaseTouchHist);
+        printf("\n");
+        fflush(stdout);
+    }
+
+    munmap(region, maxPages * pageSize);
+    return 0;
+}